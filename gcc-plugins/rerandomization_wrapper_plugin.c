@@ -738,9 +738,11 @@ static unsigned int rerandomization_wrapper_instrument_execute(void) {
     return 0;
 }
 
+// Randomized code is reached as __FIXED_rand_ctl base + name@GOTOFF, so that
+// a move updates the base only, see struct mod_rand_ctl
 void CALL_MOD_FUNC(const char * function_name1, FILE * file) {
-    const char * insn10 = "mov ";
-    const char * insn20 = "@GOTPCREL(%rip), %rax";
+    const char * insn10 = "movabs $";
+    const char * insn20 = "@GOTOFF, %rax";
     char dest2[strlen(insn10) + strlen(insn20) + strlen(function_name1)] = "";
     strcat(dest2, insn10);
     strcat(dest2, function_name1);
@@ -750,12 +752,27 @@ void CALL_MOD_FUNC(const char * function_name1, FILE * file) {
 
     DEBUG_OUTPUT("Gimple: %s\n", gimple_asm_string(g1));
     OUTPUT_INSN(gimple_asm_string(g1), file);
+    OUTPUT_INSN("add __FIXED_rand_ctl(%rip), %rax", file);
 
     gasm * g2 = gimple_build_asm_vec("call *%rax", NULL, NULL, NULL, NULL);
     gimple_asm_set_volatile (g2, true);
     OUTPUT_INSN(gimple_asm_string(g2), file);
 }
 
+// Same as CALL_MOD_FUNC, as a tail call
+void JMP_MOD_FUNC(const char * function_name1, FILE * file) {
+    const char * insn10 = "movabs $";
+    const char * insn20 = "@GOTOFF, %rax";
+    char dest2[strlen(insn10) + strlen(insn20) + strlen(function_name1)] = "";
+    strcat(dest2, insn10);
+    strcat(dest2, function_name1);
+    strcat(dest2, insn20);
+
+    OUTPUT_INSN(dest2, file);
+    OUTPUT_INSN("add __FIXED_rand_ctl(%rip), %rax", file);
+    OUTPUT_INSN("jmp *%rax", file);
+}
+
 void CALL_KERNEL_FUNC(const char * function_name, FILE * file) {
     const char * insn1 = "movabs ";
     const char * insn2 = ", %rax";
@@ -774,7 +791,49 @@ void CALL_KERNEL_FUNC(const char * function_name, FILE * file) {
     OUTPUT_INSN(gimple_asm_string(g2), file);
 }
 
+// SMR domain of the module, at MOD_RAND_CTL_SMR in struct mod_rand_ctl
+#define MOD_LOAD_SMR(reg, file) \
+    OUTPUT_INSN("mov __FIXED_rand_ctl+8(%rip), %" reg, file)
+
+// Count the call inline when the domain has counters, at SMR_FAST_CNT and
+// SMR_FAST_IDX of struct smr_domain_fast, else call smr_enter/smr_leave.
+// Same as MOD_SMR_ENTER/MOD_SMR_LEAVE in asm/module.h
+void MOD_SMR_ENTER(FILE * file) {
+    MOD_LOAD_SMR("rdi", file);
+    OUTPUT_INSN("mov 8(%rdi), %rax", file);
+    OUTPUT_INSN("test %rax, %rax", file);
+    OUTPUT_INSN("jz 1f", file);
+    OUTPUT_INSN("incl %gs:__preempt_count", file);
+    OUTPUT_INSN("mov 0(%rdi), %rdx", file);
+    OUTPUT_INSN("lea (%rax,%rdx,8), %rax", file);
+    OUTPUT_INSN("incq %gs:(%rax)", file);
+    OUTPUT_INSN("decl %gs:__preempt_count", file);
+    // preempt_enable(): reschedule if it came due with preemption off
+    OUTPUT_INSN("jnz 2f", file);
+    OUTPUT_INSN("push %rax", file);
+    OUTPUT_INSN("push %rdx", file);
+    CALL_KERNEL_FUNC("smr_resched", file);
+    OUTPUT_INSN("pop %rdx", file);
+    OUTPUT_INSN("pop %rax", file);
+    OUTPUT_INSN("jmp 2f", file);
+    OUTPUT_INSN("1:", file);
+    CALL_KERNEL_FUNC("smr_enter", file);
+    OUTPUT_INSN("2:", file);
+}
+
+void MOD_SMR_LEAVE(FILE * file) {
+    MOD_LOAD_SMR("rdx", file);
+    OUTPUT_INSN("cmpq $0, 8(%rdx)", file);
+    OUTPUT_INSN("je 1f", file);
+    OUTPUT_INSN("decq %gs:(%rdi)", file);
+    OUTPUT_INSN("jmp 2f", file);
+    OUTPUT_INSN("1:", file);
+    CALL_KERNEL_FUNC("smr_leave", file);
+    OUTPUT_INSN("2:", file);
+}
+
 void MOD_GET_STACK(FILE * file) {
+    MOD_LOAD_SMR("rdi", file);
     CALL_KERNEL_FUNC("module_get_stack", file);
     OUTPUT_INSN("mov %rax, %rsp", file);
 }
@@ -788,11 +847,58 @@ void MOD_OFFER_STACK_CALL(FILE * file) {
 	CALL_KERNEL_FUNC("module_offer_stack", file);
 }
 
+// MOD_STACK_SIZE in asm/module.h: THREAD_SIZE, doubled with CONFIG_KASAN,
+// whose modules are built with -fsanitize=kernel-address. Objects built
+// with KASAN_SANITIZE := n in a KASAN kernel must pass it explicitly:
+// -fplugin-arg-rerandomization_wrapper_plugin-stack-size=0x8000
+static unsigned long mod_stack_size;
+
+// Nested in a call into the same SMR domain, on the stack it got from
+// module_get_stack(), which is module_stack_cur, MOD_STACK_SIZE large and
+// starts with the domain: jump straight to the randomized function, see
+// MOD_NESTED. r11 is free at function entry
+void MOD_NESTED(const char * function_name, FILE * file) {
+    char range[32];
+
+    snprintf(range, sizeof(range), "cmp $%#lx, %%r11", mod_stack_size);
+    OUTPUT_INSN("mov %gs:module_stack_cur, %rax", file);
+    OUTPUT_INSN("mov %rsp, %r11", file);
+    OUTPUT_INSN("sub %rax, %r11", file);
+    OUTPUT_INSN(range, file);
+    OUTPUT_INSN("jae 3f", file);
+    OUTPUT_INSN("mov (%rax), %rax", file);
+    OUTPUT_INSN("cmp __FIXED_rand_ctl+8(%rip), %rax", file);
+    OUTPUT_INSN("jne 3f", file);
+    JMP_MOD_FUNC(function_name, file);
+    OUTPUT_INSN("3:", file);
+}
+
+// In softirq, the module's domain holding the lease of the CPU (smr_lease,
+// first field) is already entered: jump straight to the randomized
+// function, see MOD_LEASED. 0x100 is SOFTIRQ_OFFSET
+void MOD_LEASED(const char * function_name, FILE * file) {
+    OUTPUT_INSN("testl $0x100, %gs:__preempt_count", file);
+    OUTPUT_INSN("jz 4f", file);
+    OUTPUT_INSN("mov %gs:smr_lease, %rax", file);
+    OUTPUT_INSN("cmp __FIXED_rand_ctl+8(%rip), %rax", file);
+    OUTPUT_INSN("jne 4f", file);
+    JMP_MOD_FUNC(function_name, file);
+    OUTPUT_INSN("4:", file);
+}
+
 void function_prologue(FILE *file) {
 	if (lookup_key(real_function_hash_table, DECL_NAME_POINTER(current_function_decl))) {
 	//if (wrapper_function_exists()) {
 	//if (strstr(DECL_NAME_POINTER(current_function_decl), "real")) {
 
+		const char * str = DECL_NAME_POINTER(current_function_decl);
+	    char dest[strlen(str) + strlen(".real")] = "";
+	    strcat(dest, str);
+	    strcat(dest, ".real");
+
+		MOD_NESTED(dest, file);
+		MOD_LEASED(dest, file);
+
 		/* Save base pointer */
 		OUTPUT_INSN("push %rbp", file);
 		OUTPUT_INSN("mov %rsp,%rbp", file);
@@ -807,7 +913,7 @@ void function_prologue(FILE *file) {
 
 		/* Call smr_enter save return */
 		//CALL_KERNEL_FUNC(smr_enter);
-		CALL_KERNEL_FUNC("smr_enter", file);
+		MOD_SMR_ENTER(file);
 
 		OUTPUT_INSN("push %rax", file);
 		OUTPUT_INSN("push %rdx", file);
@@ -823,13 +929,8 @@ void function_prologue(FILE *file) {
 		OUTPUT_INSN("mov -0x10(%rbp), %rsi", file);
 		OUTPUT_INSN("mov -0x8(%rbp), %rdi", file);
 
-		const char * str = DECL_NAME_POINTER(current_function_decl);
-
 //		s[len] = '\0';
 		//const char * st = clone_function_name_with_underscore(str, REAL_FN_NAME_SUFFIX);
-	    char dest[strlen(str) + strlen(".real")] = "";
-	    strcat(dest, str);
-	    strcat(dest, ".real");
 		
 //		const char * str = DECL_NAME_POINTER(current_function_decl);
 //		int len = strlen(str) - strlen(".real");
@@ -855,7 +956,7 @@ void function_prologue(FILE *file) {
 		OUTPUT_INSN("pop %rdi", file);
 		
 		OUTPUT_INSN("add $48, %rsp", file);
-		CALL_KERNEL_FUNC("smr_leave", file);
+		MOD_SMR_LEAVE(file);
 		OUTPUT_INSN("mov %rbp, %rax", file);
 
 		/* Restore base pointer */
@@ -871,6 +972,9 @@ static void rerandomization_wrapper_plugin_start_unit(void *gcc_data, void *user
 	//targetm.asm_out.final_postscan_insn = final_postscan_insn;
 	
 	targetm.asm_out.function_prologue = function_prologue;
+	if (!mod_stack_size)
+		mod_stack_size = (flag_sanitize & SANITIZE_KERNEL_ADDRESS) ?
+				 0x8000 : 0x4000;
 	struct cgraph_node * node;
 	FOR_EACH_DEFINED_FUNCTION (node) {
 		TREE_PUBLIC(node->decl) = 1;
@@ -888,6 +992,7 @@ plugin_init(struct plugin_name_args *plugin_info,
             struct plugin_gcc_version *version) {
 
     const char *const plugin_name = plugin_info->base_name;
+    int i;
 
     PASS_INFO(rerandomization_wrapper_instrument, "ssa", 1, PASS_POS_INSERT_AFTER);
 
@@ -896,6 +1001,22 @@ plugin_init(struct plugin_name_args *plugin_info,
         return 1;
     }
 
+    for (i = 0; i < plugin_info->argc; i++) {
+        const struct plugin_argument *arg = &plugin_info->argv[i];
+
+        if (!strcmp(arg->key, "stack-size") && arg->value) {
+            mod_stack_size = strtoul(arg->value, NULL, 0);
+            if (!mod_stack_size || (mod_stack_size & (mod_stack_size - 1))) {
+                error(G_("stack-size must be a power of two"));
+                return 1;
+            }
+        } else {
+            error(G_("unknown option '-fplugin-arg-%s-%s'"), plugin_name,
+                  arg->key);
+            return 1;
+        }
+    }
+
     register_callback(plugin_name, PLUGIN_START_UNIT,
                       rerandomization_wrapper_plugin_start_unit, NULL);
 